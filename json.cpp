@@ -1,7 +1,18 @@
 #include "json.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iomanip>
+#include <iterator>
+#include <mutex>
+#include <sstream>
 #include <string_view>
+#include <thread>
+#include <utility>
 
 using namespace std;
 
@@ -12,22 +23,18 @@ namespace json {
             return c >= 'a' && c <= 'z';
         }
 
-        Node LoadNode(istream& input);
-
-        Node LoadArray(istream& input) {
-            Array result;
-            char c;
-            while (input >> c && c != ']') {
-                if (c != ',') {
-                    input.putback(c);
+        // Reads the next non-whitespace character straight from the stream
+        // buffer, without the sentry operator>> builds on every call.
+        bool ReadNonSpace(istream& input, char& c) {
+            streambuf* buffer = input.rdbuf();
+            for (int ch = buffer->sbumpc(); ch != char_traits<char>::eof(); ch = buffer->sbumpc()) {
+                if (!std::isspace(ch)) {
+                    c = static_cast<char>(ch);
+                    return true;
                 }
-                result.push_back(LoadNode(input));
-            }
-
-            if (c != ']') {
-                throw ParsingError("Invalid array"s);
             }
-            return Node(move(result));
+            input.setstate(ios_base::eofbit | ios_base::failbit);
+            return false;
         }
 
         Node LoadSpecialValue(istream& input) {    
@@ -52,46 +59,54 @@ namespace json {
             }
         }
 
-        Node LoadNumber(istream& input) {    
+        Node LoadNumber(istream& input, string& parsed_num) {    
 
-            string parsed_num;
+            parsed_num.clear();
 
-            auto read_char = [&parsed_num, &input] {
-                parsed_num += static_cast<char>(input.get());
-                if (!input) {
-                    throw ParsingError("Failed to read number from stream"s);
+            // Works on the stream buffer directly, peek and get would build a
+            // sentry for every digit.
+            streambuf* buffer = input.rdbuf();
+            auto peek = [&input, buffer] {
+                int ch = buffer->sgetc();
+                if (ch == char_traits<char>::eof()) {
+                    input.setstate(ios_base::eofbit);
                 }
+                return ch;
+            };
+
+            auto read_char = [&parsed_num, buffer] {
+                parsed_num += static_cast<char>(buffer->sbumpc());
             };
             
-            auto read_digits = [&input, read_char] {
-                if (!std::isdigit(input.peek())) {
+            auto read_digits = [peek, read_char] {
+                if (!std::isdigit(peek())) {
                     throw ParsingError("A digit is expected"s);
                 }
-                while (std::isdigit(input.peek())) {
+                while (std::isdigit(peek())) {
                     read_char();
                 }
             };
 
-            if (input.peek() == '-') {
+            if (peek() == '-') {
                 read_char();
             }
             
-            if (input.peek() == '0') {
+            if (peek() == '0') {
                 read_char();                
             } else {
                 read_digits();
             }
 
             bool is_int = true;
-            if (input.peek() == '.') {
+            if (peek() == '.') {
                 read_char();
                 read_digits();
                 is_int = false;
             }
             
-            if (int ch = input.peek(); ch == 'e' || ch == 'E') {
+            if (int ch = peek(); ch == 'e' || ch == 'E') {
                 read_char();
-                if (ch = input.peek(); ch == '+' || ch == '-') {
+                if (ch = peek(); ch == '+' || ch == '-') {
                     read_char();
                 }
                 read_digits();
@@ -111,14 +126,20 @@ namespace json {
             }
         }
 
-        Node LoadString(istream& input) {
-            char c = ' ';
+        // Reads through the stream buffer: istream::get builds a sentry for
+        // every character, which dominates the cost of long strings.
+        void ReadString(istream& input, string& line) {
+            streambuf* buffer = input.rdbuf();
+            const auto eof = char_traits<char>::eof();
             char previous_c = '\\';
-            string line;
-            while(!input.eof()) {
-                c = input.get();
-                if (c == '\\' && !input.eof()) {
-                    c = input.get();
+            for (int ch = buffer->sbumpc(); ch != eof; ch = buffer->sbumpc()) {
+                char c = static_cast<char>(ch);
+                if (c == '\\') {
+                    ch = buffer->sbumpc();
+                    if (ch == eof) {
+                        break;
+                    }
+                    c = static_cast<char>(ch);
                     if (c == 'r') {
                         line += '\r';
                     } else if (c == 'n') {
@@ -131,92 +152,567 @@ namespace json {
                         line += '\\';
                     }
                     previous_c = c;
-                } else 
-                if (c == '\"' && previous_c != '\\') {
-                    break;
+                } else if (c == '\"' && previous_c != '\\') {
+                    return;
                 } else {
                     line += c;
                     previous_c = c;
-                }        
-            }
-            
-            if (c != '\"') {
-                throw ParsingError("Invalid string"s);
+                }
             }
+
+            input.setstate(ios_base::eofbit | ios_base::failbit);
+            throw ParsingError("Invalid string"s);
+        }
+
+        Node LoadString(istream& input) {
+            string line;
+            ReadString(input, line);
             return Node(move(line));
         }
 
-        Node LoadDict(istream& input) {
-            Dict result;
+        void SkipString(istream& input) {
             char c;
-            while (input >> c && c != '}') {
-                if (c == ',') {
-                    input >> c;
+            while (input.get(c)) {
+                if (c == '\\') {
+                    input.get(c);
+                } else if (c == '\"') {
+                    return;
+                }
+            }
+            throw ParsingError("Invalid string"s);
+        }
+
+        void SkipNumber(istream& input, char c) {
+            const auto skip_digits = [&input] {
+                if (!std::isdigit(input.peek())) {
+                    throw ParsingError("A digit is expected"s);
+                }
+                while (std::isdigit(input.peek())) {
+                    input.get();
                 }
+            };
 
-                string key = LoadString(input).AsString();
-                input >> c;
-                result.insert({move(key), LoadNode(input)});
+            if (c == '-') {
+                if (!std::isdigit(input.peek())) {
+                    throw ParsingError("A digit is expected"s);
+                }
+                c = static_cast<char>(input.get());
+            }
+            if (c != '0') {
+                while (std::isdigit(input.peek())) {
+                    input.get();
+                }
+            }
+            if (input.peek() == '.') {
+                input.get();
+                skip_digits();
+            }
+            if (int ch = input.peek(); ch == 'e' || ch == 'E') {
+                input.get();
+                if (ch = input.peek(); ch == '+' || ch == '-') {
+                    input.get();
+                }
+                skip_digits();
             }
+        }
 
-            if (c != '}') {
-                throw ParsingError("Invalid dictionary"s);
+        void SkipScalar(istream& input, char c) {
+            if (IsLowercaseLetter(c)) {
+                char literal[6] = {c};
+                size_t size = 1;
+                while (size < sizeof(literal) && IsLowercaseLetter(static_cast<char>(input.peek()))) {
+                    literal[size++] = static_cast<char>(input.get());
+                }
+                const string_view value(literal, size);
+                if (value != "true"sv && value != "false"sv && value != "null"sv) {
+                    throw ParsingError("Invalid special value"s);
+                }
+            } else if (c == '-' || std::isdigit(c)) {
+                SkipNumber(input, c);
+            } else {
+                throw ParsingError("Invalid JSON"s);
             }
-            return Node(move(result));
         }
 
-        Node LoadNode(istream& input) {
-            char c;
-            input >> c;
+        // Consumes one value without building it, with the same checks as the
+        // full parser. Expected closers are kept in the reusable closers
+        // buffer, so no allocation happens per value.
+        void SkipNode(istream& input, string& closers) {
+            const auto read = [&input] {
+                char c;
+                if (!ReadNonSpace(input, c)) {
+                    throw ParsingError("Invalid JSON"s);
+                }
+                return c;
+            };
+            // Skips a dict key and its colon; returns the start of the value.
+            const auto skip_key = [&input, &read](char c) {
+                if (c != '"') {
+                    throw ParsingError("Invalid dictionary"s);
+                }
+                SkipString(input);
+                if (read() != ':') {
+                    throw ParsingError("Invalid dictionary"s);
+                }
+                return read();
+            };
 
-            if (c == '[') {
-                return LoadArray(input);
-            } else if (c == '{') {
-                return LoadDict(input);
-            } else if (c == '"') {
+            closers.clear();
+            char c = read();
+            for (;;) {
+                if (c == '[' || c == '{') {
+                    closers += c == '[' ? ']' : '}';
+                    c = read();
+                    if (c != closers.back()) {
+                        if (closers.back() == '}') {
+                            c = skip_key(c);
+                        }
+                        continue;
+                    }
+                    closers.pop_back();
+                } else if (c == '"') {
+                    SkipString(input);
+                } else {
+                    SkipScalar(input, c);
+                }
+
+                for (;;) {
+                    if (closers.empty()) {
+                        return;
+                    }
+                    c = read();
+                    if (c == closers.back()) {
+                        closers.pop_back();
+                        continue;
+                    }
+                    if (c != ',') {
+                        throw ParsingError(closers.back() == '}' ? "Invalid dictionary"s : "Invalid array"s);
+                    }
+                    c = read();
+                    if (closers.back() == '}') {
+                        c = skip_key(c);
+                    }
+                    break;
+                }
+            }
+        }
+
+        Node LoadScalar(istream& input, char c, string& number_buffer) {
+            if (c == '"') {
                 return LoadString(input);
             } else if (c == 't' || c == 'f' || c == 'n') {
                 input.putback(c);
                 return LoadSpecialValue(input);
             } else if (c == '-' || std::isdigit(c)) {
                 input.putback(c);
-                return LoadNumber(input);
+                return LoadNumber(input, number_buffer);
             } else {
                 throw ParsingError("Invalid JSON"s);
             }
         }
+
+        constexpr size_t kMaxRecycled = 1 << 14;
+
+        // Whether taking the value apart returns any heap storage; short
+        // strings live inline and are not worth a trip through the pool.
+        bool HasStorage(const Node& node) {
+            if (node.IsString()) {
+                return node.AsString().capacity() > string().capacity();
+            }
+            return node.IsArray() || node.IsMap();
+        }
     } //namespace
 
-    void NodePrinter::operator()(Array array) const {
-            bool is_first = true;
-            out << "["sv;
-            for (const Node& node: array) {
-                if (is_first){
-                    node.Print(out);
-                    is_first = false;
-                } else {
-                    out << ","sv;
-                    node.Print(out);
-                }                
+    void Parser::BufferReader::Reset(std::string_view buffer) {
+        char* begin = const_cast<char*>(buffer.data());
+        setg(begin, begin, begin + buffer.size());
+    }
+
+    Parser::BufferReader::pos_type Parser::BufferReader::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+        if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::in)) {
+            return pos_type(off_type(-1));
+        }
+        return pos_type(gptr() - eback());
+    }
+
+    Parser::Parser(LoadSettings settings)
+        : settings_(settings)
+        , input_(&reader_) {
+    }
+
+    Document Parser::Parse(istream& input) {
+        if (settings_.keep_source) {
+            return ParseSource(string(istreambuf_iterator<char>(input), istreambuf_iterator<char>{}));
+        }
+        return Document{ParseNode(input)};
+    }
+
+    Document Parser::Parse(std::string_view buffer) {
+        if (settings_.keep_source) {
+            return ParseSource(string(buffer));
+        }
+        reader_.Reset(buffer);
+        input_.clear();
+        return Document{ParseNode(input_)};
+    }
+
+    Document Parser::Parse(std::string_view buffer, Document&& recycled) {
+        Recycle(move(recycled));
+        return Parse(buffer);
+    }
+
+    vector<Document> Parser::ParseMany(const vector<std::string_view>& buffers) {
+        vector<Document> result;
+        result.reserve(buffers.size());
+        for (std::string_view buffer : buffers) {
+            result.push_back(Parse(buffer));
+        }
+        return result;
+    }
+
+    // Takes the document apart and keeps the storage of its arrays, strings
+    // and dict entries for the following parses.
+    void Parser::Recycle(Document&& doc) {
+        doc.source_.clear();
+        doc.source_map_ = SourceMap{};
+        doc.hash_.store(0, memory_order_relaxed);
+        recycle_stack_.push_back(move(doc.root_));
+        while (!recycle_stack_.empty()) {
+            Node node = move(recycle_stack_.back());
+            recycle_stack_.pop_back();
+
+            if (Array* array = std::get_if<Array>(&node.value_)) {
+                for (Node& item : *array) {
+                    if (HasStorage(item)) {
+                        recycle_stack_.push_back(move(item));
+                    }
+                }
+                array->clear();
+                if (arrays_.size() < kMaxRecycled) {
+                    arrays_.push_back(move(*array));
+                }
+            } else if (Dict* dict = std::get_if<Dict>(&node.value_)) {
+                while (!dict->empty()) {
+                    Dict::node_type entry = dict->extract(dict->begin());
+                    if (HasStorage(entry.mapped())) {
+                        recycle_stack_.push_back(move(entry.mapped()));
+                    }
+                    if (dict_nodes_.size() < kMaxRecycled) {
+                        entry.mapped() = Node();
+                        dict_nodes_.push_back(move(entry));
+                    }
+                }
+            } else if (string* str = std::get_if<string>(&node.value_)) {
+                if (strings_.size() < kMaxRecycled) {
+                    str->clear();
+                    strings_.push_back(move(*str));
+                }
+            }
+        }
+    }
+
+    Document Parser::ParseSource(string source) {
+        reader_.Reset(source);
+        input_.clear();
+        Node root = ParseNode(input_);
+        return Document(move(root), move(source), move(source_map_));
+    }
+
+    // Parses a document with an explicit stack of open containers instead
+    // of recursion, so hostile nesting fails with ParsingError rather than
+    // exhausting the call stack.
+    Node Parser::ParseNode(istream& input) {
+        // Does not hold on to the stack of an unusually deep previous document.
+        if (frames_.size() > kMaxRecycled) {
+            frames_.resize(kMaxRecycled);
+            frames_.shrink_to_fit();
+            maps_.clear();
+            maps_.shrink_to_fit();
+        }
+        depth_ = 0;
+        const bool keep_source = settings_.keep_source;
+        if (keep_source) {
+            value_map_ = SourceMap{};
+        }
+        const Projection* projection = settings_.projection;
+        for (;;) {
+            Node value;
+            char c;
+            if (!ReadNonSpace(input, c)) {
+                throw ParsingError("Invalid JSON"s);
+            }
+
+            if (c == '[' || c == '{') {
+                Frame& frame = Push(c == '{', projection);
+                if (keep_source) {
+                    OpenMap(input);
+                }
+                if (NextValue(input, frame, true)) {
+                    projection = frame.value_projection;
+                    continue;
+                }
+                value = Pop();
+                if (keep_source) {
+                    CloseMap(input);
+                }
+            } else if (c == '"') {
+                string line = TakeString();
+                ReadString(input, line);
+                value = Node(move(line));
+            } else {
+                value = LoadScalar(input, c, number_buffer_);
+            }
+
+            for (;;) {
+                if (depth_ == 0) {
+                    if (keep_source) {
+                        source_map_ = move(value_map_);
+                    }
+                    return value;
+                }
+                Frame& frame = frames_[depth_ - 1];
+                if (keep_source) {
+                    AttachMap(frame);
+                }
+                Append(frame, move(value));
+                if (NextValue(input, frame, false)) {
+                    projection = frame.value_projection;
+                    break;
+                }
+                value = Pop();
+                if (keep_source) {
+                    CloseMap(input);
+                }
+            }
+        }
+    }
+
+    Parser::Frame& Parser::Push(bool is_dict, const Projection* projection) {
+        if (depth_ == settings_.max_depth) {
+            throw ParsingError("Maximum nesting depth exceeded"s);
+        }
+        if (depth_ == frames_.size()) {
+            frames_.emplace_back();
+        }
+        Frame& frame = frames_[depth_++];
+        frame.is_dict = is_dict;
+        frame.array.clear();
+        frame.dict.clear();
+        if (!is_dict && frame.array.capacity() == 0 && !arrays_.empty()) {
+            frame.array = move(arrays_.back());
+            arrays_.pop_back();
+        }
+        frame.projection = projection;
+        frame.value_projection = projection;
+        return frame;
+    }
+
+    Node Parser::Pop() {
+        Frame& frame = frames_[--depth_];
+        if (frame.is_dict) {
+            return Node(move(frame.dict));
+        }
+        return Node(move(frame.array));
+    }
+
+    void Parser::OpenMap(istream& input) {
+        if (maps_.size() < depth_) {
+            maps_.resize(depth_);
+        }
+        SourceMap& map = maps_[depth_ - 1];
+        map = SourceMap{};
+        map.begin = static_cast<size_t>(input.tellg()) - 1;
+    }
+
+    // Called after Pop: finishes the map of the closed container.
+    void Parser::CloseMap(istream& input) {
+        SourceMap& map = maps_[depth_];
+        map.end = static_cast<size_t>(input.tellg());
+        value_map_ = move(map);
+    }
+
+    // Hands the map of the finished value to its parent. Scalars have no
+    // map; a modified child makes its parent modified too.
+    void Parser::AttachMap(const Frame& frame) {
+        if (value_map_.begin == value_map_.end) {
+            return;
+        }
+        SourceMap& parent = maps_[depth_ - 1];
+        parent.dirty = parent.dirty || value_map_.dirty;
+        if (frame.is_dict) {
+            parent.fields.emplace(frame.key, move(value_map_));
+        } else {
+            parent.items.resize(frame.array.size());
+            parent.items.push_back(move(value_map_));
+        }
+        value_map_ = SourceMap{};
+    }
+
+    // Dict entries reuse map nodes of recycled documents, key storage
+    // included; duplicate keys keep the first value as before.
+    void Parser::Append(Frame& frame, Node&& value) {
+        if (!frame.is_dict) {
+            frame.array.push_back(move(value));
+            return;
+        }
+        if (dict_nodes_.empty()) {
+            frame.dict.emplace(move(frame.key), move(value));
+            return;
+        }
+
+        Dict::node_type entry = move(dict_nodes_.back());
+        dict_nodes_.pop_back();
+        entry.key() = frame.key;
+        entry.mapped() = move(value);
+        auto result = frame.dict.insert(move(entry));
+        if (!result.inserted) {
+            result.node.mapped() = Node();
+            dict_nodes_.push_back(move(result.node));
+        }
+    }
+
+    // Reads up to the start of the next value the frame keeps, skipping
+    // members outside the projection; false means the container closed.
+    bool Parser::NextValue(istream& input, Frame& frame, bool first) {
+        const char close = frame.is_dict ? '}' : ']';
+        const auto fail = [&frame] {
+            throw ParsingError(frame.is_dict ? "Invalid dictionary"s : "Invalid array"s);
+        };
+
+        char c;
+        if (!ReadNonSpace(input, c)) {
+            fail();
+        }
+        if (c == close) {
+            return false;
+        }
+        if (!first) {
+            if (c != ',' || !ReadNonSpace(input, c)) {
+                fail();
+            }
+        }
+        if (!frame.is_dict) {
+            input.putback(c);
+            return true;
+        }
+
+        for (;;) {
+            if (c != '"') {
+                fail();
+            }
+            frame.key.clear();
+            ReadString(input, frame.key);
+            if (!ReadNonSpace(input, c) || c != ':') {
+                fail();
+            }
+
+            if (!frame.projection || frame.projection->IsComplete()) {
+                frame.value_projection = nullptr;
+                return true;
+            }
+            if (const Projection* field = frame.projection->Find(frame.key)) {
+                frame.value_projection = field;
+                return true;
+            }
+
+            SkipNode(input, skip_buffer_);
+            if (settings_.keep_source) {
+                maps_[depth_ - 1].dirty = true;
+            }
+            if (!ReadNonSpace(input, c)) {
+                fail();
+            }
+            if (c == close) {
+                return false;
+            }
+            if (c != ',' || !ReadNonSpace(input, c)) {
+                fail();
             }
-            out << "]"sv;
+        }
+    }
+
+    string Parser::TakeString() {
+        if (strings_.empty()) {
+            return string();
+        }
+        string result = move(strings_.back());
+        strings_.pop_back();
+        return result;
+    }
+
+    namespace {
+
+        struct PrintFrame {
+            const Array* array = nullptr;
+            const Dict* dict = nullptr;
+            Array::const_iterator array_it;
+            Dict::const_iterator dict_it;
+            const SourceMap* map = nullptr;
+        };
+
+        void OpenContainer(const Array& array, vector<PrintFrame>& stack, std::ostream& out) {
+            out << "["sv;
+            PrintFrame frame;
+            frame.array = &array;
+            frame.array_it = array.begin();
+            stack.push_back(frame);
         }
 
-    void NodePrinter::operator()(Dict dict) const {
-            bool is_first = true;
+        void OpenContainer(const Dict& dict, vector<PrintFrame>& stack, std::ostream& out) {
             out << "{"sv;
-            for (const auto& [key, node]: dict) {
-                if (is_first){
-                    out << "\""sv << key << "\""sv << ":"sv;
-                    node.Print(out);
-                    is_first = false;
+            PrintFrame frame;
+            frame.dict = &dict;
+            frame.dict_it = dict.begin();
+            stack.push_back(frame);
+        }
+
+        // Walks nested containers with an explicit stack; only scalars go
+        // through Node::Print, so the call depth stays constant.
+        template <typename Container>
+        void PrintContainer(const Container& container, std::ostream& out) {
+            vector<PrintFrame> stack;
+            OpenContainer(container, stack, out);
+            while (!stack.empty()) {
+                PrintFrame& frame = stack.back();
+                const Node* node = nullptr;
+                if (frame.array) {
+                    if (frame.array_it == frame.array->end()) {
+                        out << "]"sv;
+                        stack.pop_back();
+                        continue;
+                    }
+                    if (frame.array_it != frame.array->begin()) {
+                        out << ","sv;
+                    }
+                    node = &*frame.array_it++;
                 } else {
-                    out << ", \""sv << key << "\""sv << ":"sv;
-                    node.Print(out);
-                }                
+                    if (frame.dict_it == frame.dict->end()) {
+                        out << "}"sv;
+                        stack.pop_back();
+                        continue;
+                    }
+                    out << (frame.dict_it == frame.dict->begin() ? "\""sv : ", \""sv) << frame.dict_it->first << "\""sv << ":"sv;
+                    node = &(frame.dict_it++)->second;
+                }
+
+                if (node->IsArray()) {
+                    OpenContainer(node->AsArray(), stack, out);
+                } else if (node->IsMap()) {
+                    OpenContainer(node->AsMap(), stack, out);
+                } else {
+                    node->Print(out);
+                }
             }
-            out << "}"sv;
         }
+    } //namespace
+
+    void NodePrinter::operator()(const Array& array) const {
+        PrintContainer(array, out);
+    }
+
+    void NodePrinter::operator()(const Dict& dict) const {
+        PrintContainer(dict, out);
+    }
 
     void NodePrinter::operator()(std::string str) const {
         std::string output_string = "\""s;
@@ -371,23 +867,771 @@ namespace json {
         return *ptr;
     }
 
+    Projection::Projection(std::initializer_list<KeyPath> paths) {
+        for (const KeyPath& path : paths) {
+            Add(path);
+        }
+    }
+
+    Projection& Projection::Add(const KeyPath& path) {
+        Projection* current = this;
+        for (const string& key : path) {
+            if (current->is_complete_) {
+                return *this;
+            }
+            current = &current->fields_[key];
+        }
+        current->is_complete_ = true;
+        current->fields_.clear();
+        return *this;
+    }
+
+    bool Projection::IsComplete() const {
+        return is_complete_;
+    }
+
+    const Projection* Projection::Find(const std::string& key) const {
+        auto it = fields_.find(key);
+        if (it == fields_.end()) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    namespace {
+
+        size_t Mix(uint64_t value) {
+            value ^= value >> 33;
+            value *= 0xff51afd7ed558ccdULL;
+            value ^= value >> 33;
+            value *= 0xc4ceb9fe1a85ec53ULL;
+            value ^= value >> 33;
+            return static_cast<size_t>(value);
+        }
+
+        // Hash of a scalar, or the seed a container's hash starts from.
+        struct NodeHasher {
+            size_t operator()(std::nullptr_t) const {
+                return 0;
+            }
+
+            size_t operator()(const Array& array) const {
+                return array.size();
+            }
+
+            size_t operator()(const Dict& dict) const {
+                return dict.size();
+            }
+
+            template <typename Value>
+            size_t operator()(const Value& value) const {
+                return std::hash<Value>{}(value);
+            }
+        };
+
+        struct HashFrame {
+            const Node* node = nullptr;
+            uint64_t result = 0;
+            Array::const_iterator array_it;
+            Dict::const_iterator dict_it;
+        };
+    } //namespace
+
+    // Hashes post-order with an explicit stack, the way PrintContainer walks
+    // the tree. Dict entries are summed so the result does not depend on key
+    // order.
+    size_t Node::Hash() const {
+        const auto finish = [](const Node& node, uint64_t result) {
+            return Mix(result * 31 + node.value_.index());
+        };
+        const auto open = [](const Node& node) {
+            HashFrame frame;
+            frame.node = &node;
+            frame.result = std::visit(NodeHasher{}, node.value_);
+            if (const Array* array = std::get_if<Array>(&node.value_)) {
+                frame.array_it = array->begin();
+            } else {
+                frame.dict_it = std::get<Dict>(node.value_).begin();
+            }
+            return frame;
+        };
+
+        if (!IsArray() && !IsMap()) {
+            return finish(*this, std::visit(NodeHasher{}, value_));
+        }
+
+        vector<HashFrame> stack{open(*this)};
+        for (;;) {
+            HashFrame& frame = stack.back();
+            const Node* child = nullptr;
+            if (const Array* array = std::get_if<Array>(&frame.node->value_)) {
+                if (frame.array_it != array->end()) {
+                    child = &*frame.array_it;
+                }
+            } else if (frame.dict_it != std::get<Dict>(frame.node->value_).end()) {
+                child = &frame.dict_it->second;
+            }
+
+            size_t hash;
+            if (!child) {
+                hash = finish(*frame.node, frame.result);
+                stack.pop_back();
+                if (stack.empty()) {
+                    return hash;
+                }
+            } else if (child->IsArray() || child->IsMap()) {
+                stack.push_back(open(*child));
+                continue;
+            } else {
+                hash = finish(*child, std::visit(NodeHasher{}, child->value_));
+            }
+
+            HashFrame& parent = stack.back();
+            if (parent.node->IsArray()) {
+                parent.result = parent.result * 31 + hash;
+                ++parent.array_it;
+            } else {
+                parent.result += Mix(std::hash<string>{}(parent.dict_it->first) * 31 + hash);
+                ++parent.dict_it;
+            }
+        }
+    }
+
     Document::Document(Node root)
         : root_(move(root)) {
     }
 
+    Document::Document(Node root, std::string source, SourceMap source_map)
+        : root_(move(root))
+        , source_(move(source))
+        , source_map_(move(source_map)) {
+    }
+
+    Document::Document(const Document& other)
+        : root_(other.root_)
+        , source_(other.source_)
+        , source_map_(other.source_map_)
+        , hash_(other.hash_.load(memory_order_relaxed)) {
+    }
+
+    Document::Document(Document&& other) noexcept
+        : root_(move(other.root_))
+        , source_(move(other.source_))
+        , source_map_(move(other.source_map_))
+        , hash_(other.hash_.exchange(0, memory_order_relaxed)) {
+    }
+
+    Document& Document::operator=(const Document& other) {
+        root_ = other.root_;
+        source_ = other.source_;
+        source_map_ = other.source_map_;
+        hash_.store(other.hash_.load(memory_order_relaxed), memory_order_relaxed);
+        return *this;
+    }
+
+    Document& Document::operator=(Document&& other) noexcept {
+        root_ = move(other.root_);
+        source_ = move(other.source_);
+        source_map_ = move(other.source_map_);
+        hash_.store(other.hash_.exchange(0, memory_order_relaxed), memory_order_relaxed);
+        return *this;
+    }
+
     const Node& Document::GetRoot() const {
         return root_;
     }
 
+    size_t Document::Hash() const {
+        size_t hash = hash_.load(memory_order_relaxed);
+        if (hash == 0) {
+            hash = root_.Hash();
+            if (hash == 0) {
+                hash = 1;
+            }
+            hash_.store(hash, memory_order_relaxed);
+        }
+        return hash;
+    }
+
     Document Load(istream& input) {
-        return Document{LoadNode(input)};
+        return Load(input, LoadSettings{});
+    }
+
+    Document Load(istream& input, const Projection& projection) {
+        LoadSettings settings;
+        settings.projection = &projection;
+        return Load(input, settings);
+    }
+
+    Document& Document::Set(const Path& path, Node value) {
+        Edit(path, EditType::kSet, move(value));
+        return *this;
+    }
+
+    Document& Document::Insert(const Path& path, Node value) {
+        Edit(path, EditType::kInsert, move(value));
+        return *this;
+    }
+
+    Document& Document::Erase(const Path& path) {
+        Edit(path, EditType::kErase, Node());
+        return *this;
+    }
+
+    // Every container on the way to the edited one is marked dirty, and the
+    // source map of the replaced or removed child is dropped.
+    void Document::Edit(const Path& path, EditType type, Node value) {
+        hash_.store(0, memory_order_relaxed);
+        if (path.empty()) {
+            if (type != EditType::kSet) {
+                throw std::invalid_argument("Empty path"s);
+            }
+            root_ = move(value);
+            source_map_ = SourceMap{};
+            return;
+        }
+
+        Node* node = &root_;
+        SourceMap* map = source_.empty() ? nullptr : &source_map_;
+        for (size_t i = 0;; ++i) {
+            if (map) {
+                map->dirty = true;
+            }
+            const bool is_last = i + 1 == path.size();
+
+            if (const string* key = std::get_if<string>(&path[i])) {
+                Dict* dict = std::get_if<Dict>(&node->value_);
+                if (!dict) {
+                    throw std::invalid_argument("Wrong variant"s);
+                }
+                if (is_last) {
+                    if (type == EditType::kSet) {
+                        (*dict)[*key] = move(value);
+                    } else if (type == EditType::kInsert) {
+                        if (!dict->emplace(*key, move(value)).second) {
+                            throw std::invalid_argument("Key already exists"s);
+                        }
+                    } else if (!dict->erase(*key)) {
+                        throw std::out_of_range("Key not found"s);
+                    }
+                    if (map) {
+                        map->fields.erase(*key);
+                    }
+                    return;
+                }
+
+                auto it = dict->find(*key);
+                if (it == dict->end()) {
+                    throw std::out_of_range("Key not found"s);
+                }
+                node = &it->second;
+                if (map) {
+                    auto field = map->fields.find(*key);
+                    map = field == map->fields.end() ? nullptr : &field->second;
+                }
+            } else {
+                const size_t index = std::get<size_t>(path[i]);
+                Array* array = std::get_if<Array>(&node->value_);
+                if (!array) {
+                    throw std::invalid_argument("Wrong variant"s);
+                }
+                if (index > array->size() || (index == array->size() && !(is_last && type == EditType::kInsert))) {
+                    throw std::out_of_range("Index out of range"s);
+                }
+                vector<SourceMap>* items = map ? &map->items : nullptr;
+                const bool has_item = items && index < items->size();
+                if (is_last) {
+                    if (type == EditType::kSet) {
+                        (*array)[index] = move(value);
+                        if (has_item) {
+                            (*items)[index] = SourceMap{};
+                        }
+                    } else if (type == EditType::kInsert) {
+                        array->insert(array->begin() + index, move(value));
+                        if (has_item) {
+                            items->insert(items->begin() + index, SourceMap{});
+                        }
+                    } else {
+                        array->erase(array->begin() + index);
+                        if (has_item) {
+                            items->erase(items->begin() + index);
+                        }
+                    }
+                    return;
+                }
+
+                node = &(*array)[index];
+                map = has_item ? &(*items)[index] : nullptr;
+            }
+        }
     }
 
+    // Each thread parses with its own parser, so Load keeps the frame stack
+    // and scratch buffers between calls instead of building them anew.
+    Document Load(istream& input, const LoadSettings& settings) {
+        thread_local Parser parser;
+        parser.settings_ = settings;
+        return parser.Parse(input);
+    }
+
+    namespace {
+
+        // Copies clean containers from the source and re-emits only the dirty
+        // ones, walking dirty containers with the PrintFrame stack.
+        void PrintWithSource(const Node& root, const SourceMap* root_map, const string& source, std::ostream& out) {
+            vector<PrintFrame> stack;
+            const auto print = [&stack, &source, &out](const Node& node, const SourceMap* map) {
+                if (!map || map->begin == map->end) {
+                    node.Print(out);
+                } else if (!map->dirty) {
+                    out.write(source.data() + map->begin, map->end - map->begin);
+                } else {
+                    if (node.IsArray()) {
+                        OpenContainer(node.AsArray(), stack, out);
+                    } else {
+                        OpenContainer(node.AsMap(), stack, out);
+                    }
+                    stack.back().map = map;
+                }
+            };
+
+            print(root, root_map);
+            while (!stack.empty()) {
+                PrintFrame& frame = stack.back();
+                const Node* node = nullptr;
+                const SourceMap* map = nullptr;
+                if (frame.array) {
+                    if (frame.array_it == frame.array->end()) {
+                        out << "]"sv;
+                        stack.pop_back();
+                        continue;
+                    }
+                    const size_t index = frame.array_it - frame.array->begin();
+                    if (index != 0) {
+                        out << ","sv;
+                    }
+                    if (index < frame.map->items.size()) {
+                        map = &frame.map->items[index];
+                    }
+                    node = &*frame.array_it++;
+                } else {
+                    if (frame.dict_it == frame.dict->end()) {
+                        out << "}"sv;
+                        stack.pop_back();
+                        continue;
+                    }
+                    out << (frame.dict_it == frame.dict->begin() ? "\""sv : ", \""sv) << frame.dict_it->first << "\""sv << ":"sv;
+                    auto field = frame.map->fields.find(frame.dict_it->first);
+                    if (field != frame.map->fields.end()) {
+                        map = &field->second;
+                    }
+                    node = &(frame.dict_it++)->second;
+                }
+                print(*node, map);
+            }
+        }
+    } //namespace
+
     void Print(const Document& doc, std::ostream& output) {
-        doc.GetRoot().Print(output);
+        if (doc.source_.empty()) {
+            doc.GetRoot().Print(output);
+            return;
+        }
+        PrintWithSource(doc.root_, &doc.source_map_, doc.source_, output);
+    }
+
+    namespace {
+
+        constexpr size_t kMaxPlanDepth = 64;
+
+        // Counts the nodes of a subtree, stopping once the count exceeds limit.
+        size_t CountNodes(const Node& root, size_t limit) {
+            size_t count = 1;
+            vector<const Node*> stack{&root};
+            const auto visit = [&count, &stack, limit](const Node& item) {
+                if (item.IsArray() || item.IsMap()) {
+                    stack.push_back(&item);
+                }
+                return ++count <= limit;
+            };
+            while (!stack.empty()) {
+                const Node* node = stack.back();
+                stack.pop_back();
+                if (node->IsArray()) {
+                    for (const Node& item : node->AsArray()) {
+                        if (!visit(item)) {
+                            return count;
+                        }
+                    }
+                } else if (node->IsMap()) {
+                    for (const auto& [key, item] : node->AsMap()) {
+                        if (!visit(item)) {
+                            return count;
+                        }
+                    }
+                }
+            }
+            return count;
+        }
+
+        // Threads shared by all parallel prints, so a print does not start
+        // and join its own. They are started on first use, grown to the
+        // largest thread count asked for and joined at exit. Jobs never wait
+        // for each other, so prints from several threads can share the pool.
+        class WorkerPool {
+        public:
+            static WorkerPool& Instance() {
+                static WorkerPool pool;
+                return pool;
+            }
+
+            ~WorkerPool() {
+                {
+                    lock_guard lock(mutex_);
+                    stopping_ = true;
+                }
+                job_added_.notify_all();
+                for (thread& worker : threads_) {
+                    worker.join();
+                }
+            }
+
+            void Reserve(size_t count) {
+                lock_guard lock(mutex_);
+                while (threads_.size() < count) {
+                    threads_.emplace_back(&WorkerPool::Loop, this);
+                }
+            }
+
+            void Submit(function<void()> job) {
+                {
+                    lock_guard lock(mutex_);
+                    jobs_.push_back(move(job));
+                }
+                job_added_.notify_one();
+            }
+
+        private:
+            WorkerPool() = default;
+
+            void Loop() {
+                for (;;) {
+                    function<void()> job;
+                    {
+                        unique_lock lock(mutex_);
+                        job_added_.wait(lock, [this] {
+                            return stopping_ || !jobs_.empty();
+                        });
+                        if (jobs_.empty()) {
+                            return;
+                        }
+                        job = move(jobs_.front());
+                        jobs_.pop_front();
+                    }
+                    job();
+                }
+            }
+
+            mutex mutex_;
+            condition_variable job_added_;
+            deque<function<void()>> jobs_;
+            vector<thread> threads_;
+            bool stopping_ = false;
+        };
+
+        void PrintSeparator(const Array& array, Array::const_iterator it, std::ostream& out) {
+            if (it != array.begin()) {
+                out << ","sv;
+            }
+        }
+
+        void PrintSeparator(const Dict& dict, Dict::const_iterator it, std::ostream& out) {
+            out << (it == dict.begin() ? "\""sv : ", \""sv) << it->first << "\""sv << ":"sv;
+        }
+
+        const Node& ValueOf(Array::const_iterator it) {
+            return *it;
+        }
+
+        const Node& ValueOf(Dict::const_iterator it) {
+            return it->second;
+        }
+
+        // Text that precedes the task, then a run of elements of one
+        // container.
+        struct PrintTask {
+            string prefix;
+            const Array* array = nullptr;
+            Array::const_iterator array_first;
+            Array::const_iterator array_last;
+            const Dict* dict = nullptr;
+            Dict::const_iterator dict_first;
+            Dict::const_iterator dict_last;
+        };
+
+        class ParallelPrinter {
+        public:
+            ParallelPrinter(const PrintSettings& settings, std::ostream& output)
+                : chunk_size_(std::max<size_t>(settings.chunk_size, 1))
+                , threads_(settings.threads != 0 ? settings.threads : std::max(std::thread::hardware_concurrency(), 1u))
+                , output_(output) {
+            }
+
+            void Print(const Node& root) {
+                if (threads_ <= 1 || CountNodes(root, chunk_size_) <= chunk_size_) {
+                    root.Print(output_);
+                    return;
+                }
+                Plan(root);
+                Run();
+            }
+
+        private:
+            PrintTask& AddTask() {
+                tasks_.emplace_back();
+                tasks_.back().prefix = move(pending_text_);
+                pending_text_.clear();
+                return tasks_.back();
+            }
+
+            void AddRun(const Array& array, Array::const_iterator first, Array::const_iterator last) {
+                PrintTask& task = AddTask();
+                task.array = &array;
+                task.array_first = first;
+                task.array_last = last;
+            }
+
+            void AddRun(const Dict& dict, Dict::const_iterator first, Dict::const_iterator last) {
+                PrintTask& task = AddTask();
+                task.dict = &dict;
+                task.dict_first = first;
+                task.dict_last = last;
+            }
+
+            struct PlanFrame {
+                const Array* array = nullptr;
+                const Dict* dict = nullptr;
+                Array::const_iterator array_it;
+                Array::const_iterator array_first;
+                Dict::const_iterator dict_it;
+                Dict::const_iterator dict_first;
+                size_t run_size = 0;
+            };
+
+            void Open(const Node& node, vector<PlanFrame>& stack) {
+                PlanFrame frame;
+                if (node.IsArray()) {
+                    pending_text_ += '[';
+                    frame.array = &node.AsArray();
+                    frame.array_it = frame.array_first = frame.array->begin();
+                } else {
+                    pending_text_ += '{';
+                    frame.dict = &node.AsMap();
+                    frame.dict_it = frame.dict_first = frame.dict->begin();
+                }
+                stack.push_back(frame);
+            }
+
+            // Plans containers with an explicit stack, like PrintContainer.
+            // Below kMaxPlanDepth large elements are not split any further,
+            // which bounds the node counting on deep chains.
+            void Plan(const Node& root) {
+                vector<PlanFrame> stack;
+                Open(root, stack);
+                while (!stack.empty()) {
+                    PlanFrame& frame = stack.back();
+                    const bool can_split = stack.size() < kMaxPlanDepth;
+                    const Node* child = frame.array
+                        ? NextLarge(*frame.array, frame.array_it, frame.array_first, frame.run_size, can_split)
+                        : NextLarge(*frame.dict, frame.dict_it, frame.dict_first, frame.run_size, can_split);
+                    if (child) {
+                        Open(*child, stack);
+                        continue;
+                    }
+                    pending_text_ += frame.array ? ']' : '}';
+                    stack.pop_back();
+                }
+            }
+
+            // Groups elements into runs of about chunk_size_ nodes. Returns
+            // the next element larger than that, with its separator already
+            // planned, or nullptr once the container is done.
+            template <typename Container, typename Iterator>
+            const Node* NextLarge(const Container& container, Iterator& it, Iterator& first, size_t& run_size, bool can_split) {
+                for (; it != container.end(); ++it) {
+                    const size_t size = CountNodes(ValueOf(it), chunk_size_);
+                    if (can_split && size > chunk_size_) {
+                        if (first != it) {
+                            AddRun(container, first, it);
+                        }
+                        ostringstream separator;
+                        PrintSeparator(container, it, separator);
+                        pending_text_ += separator.str();
+                        const Node* child = &ValueOf(it);
+                        first = ++it;
+                        run_size = 0;
+                        return child;
+                    }
+                    if ((run_size += size) >= chunk_size_) {
+                        AddRun(container, first, next(it));
+                        first = next(it);
+                        run_size = 0;
+                    }
+                }
+                if (first != container.end()) {
+                    AddRun(container, first, container.end());
+                    first = container.end();
+                }
+                return nullptr;
+            }
+
+            template <typename Container, typename Iterator>
+            static void PrintRun(const Container& container, Iterator first, Iterator last, std::ostream& out) {
+                for (auto it = first; it != last; ++it) {
+                    PrintSeparator(container, it, out);
+                    ValueOf(it).Print(out);
+                }
+            }
+
+            string Serialize(const PrintTask& task) const {
+                ostringstream out;
+                out.flags(output_.flags());
+                out.precision(output_.precision());
+                out.imbue(output_.getloc());
+                if (task.array) {
+                    PrintRun(*task.array, task.array_first, task.array_last, out);
+                } else {
+                    PrintRun(*task.dict, task.dict_first, task.dict_last, out);
+                }
+                return out.str();
+            }
+
+            // Workers stay at most a window of tasks ahead of the writer, which
+            // bounds the memory held by serialized chunks.
+            void Worker() {
+                for (;;) {
+                    size_t index;
+                    {
+                        unique_lock lock(mutex_);
+                        task_taken_.wait(lock, [this] {
+                            return failed_ || next_task_ == tasks_.size() || next_task_ < written_ + 2 * threads_;
+                        });
+                        if (failed_ || next_task_ == tasks_.size()) {
+                            return;
+                        }
+                        index = next_task_++;
+                    }
+
+                    string text;
+                    exception_ptr error;
+                    try {
+                        text = Serialize(tasks_[index]);
+                    } catch (...) {
+                        error = current_exception();
+                    }
+
+                    lock_guard lock(mutex_);
+                    results_[index] = move(text);
+                    done_[index] = true;
+                    if (error) {
+                        error_ = error;
+                        failed_ = true;
+                    }
+                    task_done_.notify_all();
+                    task_taken_.notify_all();
+                }
+            }
+
+            // Hands threads_ Worker jobs to the shared pool and writes their
+            // results in order; returns only once every job has finished.
+            void Run() {
+                results_.resize(tasks_.size());
+                done_.assign(tasks_.size(), false);
+
+                auto stop = [this] {
+                    unique_lock lock(mutex_);
+                    failed_ = true;
+                    task_taken_.notify_all();
+                    task_done_.wait(lock, [this] {
+                        return running_ == 0;
+                    });
+                };
+
+                // Jobs that were never submitted are taken off running_ on
+                // failure.
+                running_ = threads_;
+                size_t submitted = 0;
+                try {
+                    WorkerPool& pool = WorkerPool::Instance();
+                    pool.Reserve(threads_);
+                    for (; submitted < threads_; ++submitted) {
+                        pool.Submit([this] {
+                            Worker();
+                            lock_guard lock(mutex_);
+                            --running_;
+                            task_done_.notify_all();
+                        });
+                    }
+                    for (size_t i = 0; i < tasks_.size(); ++i) {
+                        output_ << tasks_[i].prefix;
+                        string text;
+                        {
+                            unique_lock lock(mutex_);
+                            task_done_.wait(lock, [this, i] {
+                                return done_[i] || error_;
+                            });
+                            if (error_) {
+                                rethrow_exception(error_);
+                            }
+                            text = move(results_[i]);
+                            written_ = i + 1;
+                        }
+                        task_taken_.notify_all();
+                        output_ << text;
+                    }
+                    output_ << pending_text_;
+                } catch (...) {
+                    {
+                        lock_guard lock(mutex_);
+                        running_ -= threads_ - submitted;
+                    }
+                    stop();
+                    throw;
+                }
+                stop();
+            }
+
+            const size_t chunk_size_;
+            const size_t threads_;
+            std::ostream& output_;
+            vector<PrintTask> tasks_;
+            string pending_text_;
+
+            mutex mutex_;
+            condition_variable task_taken_;
+            condition_variable task_done_;
+            vector<string> results_;
+            vector<bool> done_;
+            size_t next_task_ = 0;
+            size_t written_ = 0;
+            size_t running_ = 0;
+            bool failed_ = false;
+            exception_ptr error_;
+        };
+    } //namespace
+
+    void Print(const Document& doc, std::ostream& output, const PrintSettings& settings) {
+        if (!doc.source_.empty()) {
+            Print(doc, output);
+            return;
+        }
+        ParallelPrinter(settings, output).Print(doc.GetRoot());
     }
 
     bool operator==(const Node& lhs, const Node& rhs) {
+        if (&lhs == &rhs) {
+            return true;
+        }
         return lhs.value_ == rhs.value_;
     }
 
@@ -395,7 +1639,15 @@ namespace json {
         return !(lhs == rhs);
     }
 
+    // Documents are compared by their memoized hashes first, so repeated
+    // comparisons of distinct documents stay cheap.
     bool operator==(const Document& lhs, const Document& rhs) {
+        if (&lhs == &rhs) {
+            return true;
+        }
+        if (lhs.Hash() != rhs.Hash()) {
+            return false;
+        }
         return rhs.root_ == lhs.root_;
     }
 
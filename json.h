@@ -1,8 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 
@@ -17,8 +21,8 @@ namespace json {
         
         std::ostream& out;
         void operator()(std::nullptr_t) const;    
-        void operator()(Array array) const;    
-        void operator()(Dict dict) const;    
+        void operator()(const Array& array) const;    
+        void operator()(const Dict& dict) const;    
         void operator()(bool value) const;    
         void operator()(int value) const;    
         void operator()(double value) const;    
@@ -55,26 +59,198 @@ namespace json {
         double AsDouble() const;
         bool AsBool() const;
         const std::string& AsString() const;
+        // Structural hash; walks the whole subtree on every call, O(n) and
+        // not memoized. Use Document::Hash for repeated lookups.
+        std::size_t Hash() const;
         friend bool operator==(const Node& lhs, const Node& rhs);
         friend bool operator!=(const Node& lhs, const Node& rhs);
 
     private:
+        friend class Document;
+        friend class Parser;
+
         CurrentNode value_;  
     };
 
+    using PathItem = std::variant<std::string, std::size_t>;
+    using Path = std::vector<PathItem>;
+
+    // Byte range of a loaded container in the source text. A dirty range
+    // has modified descendants and is printed member by member; items and
+    // fields only hold entries for children that are containers themselves.
+    struct SourceMap {
+        std::size_t begin = 0;
+        std::size_t end = 0;
+        bool dirty = false;
+        std::vector<SourceMap> items;
+        std::map<std::string, SourceMap> fields;
+    };
+
+    struct PrintSettings;
+
     class Document {
     public:
         explicit Document(Node root);
+        Document(Node root, std::string source, SourceMap source_map);
+        Document(const Document& other);
+        Document(Document&& other) noexcept;
+        Document& operator=(const Document& other);
+        Document& operator=(Document&& other) noexcept;
         const Node& GetRoot() const;
+        // Structural hash of the root, memoized until the next edit.
+        std::size_t Hash() const;
+
+        Document& Set(const Path& path, Node value);
+        Document& Insert(const Path& path, Node value);
+        Document& Erase(const Path& path);
+
         friend bool operator==(const Document& lhs, const Document& rhs);
         friend bool operator!=(const Document& lhs, const Document& rhs);
+        friend void Print(const Document& doc, std::ostream& output);
+        friend void Print(const Document& doc, std::ostream& output, const PrintSettings& settings);
 
     private:
+        friend class Parser;
+
+        enum class EditType {
+            kSet,
+            kInsert,
+            kErase
+        };
+
+        void Edit(const Path& path, EditType type, Node value);
+
         Node root_;
+        std::string source_;
+        SourceMap source_map_;
+        // Zero until computed; the value is idempotent, so relaxed atomic
+        // accesses let const documents be hashed from several threads.
+        mutable std::atomic<std::size_t> hash_{0};
+    };
+
+    using KeyPath = std::vector<std::string>;
+
+    class Projection {
+    public:
+        Projection() = default;
+        Projection(std::initializer_list<KeyPath> paths);
+
+        Projection& Add(const KeyPath& path);
+        bool IsComplete() const;
+        const Projection* Find(const std::string& key) const;
+
+    private:
+        std::map<std::string, Projection> fields_;
+        bool is_complete_ = false;
+    };
+
+    struct LoadSettings {
+        std::size_t max_depth = 1000;
+        const Projection* projection = nullptr;
+        // Keeps the source text so that Print copies unmodified containers
+        // verbatim. Reads the input stream to its end.
+        bool keep_source = false;
+    };
+
+    // Parses documents with an explicit container stack (see
+    // LoadSettings::max_depth) and keeps its buffers between calls: the
+    // stack, scratch strings and containers taken from recycled documents.
+    // One parser must not be used from several threads at once.
+    class Parser {
+    public:
+        explicit Parser(LoadSettings settings = {});
+
+        Document Parse(std::istream& input);
+        Document Parse(std::string_view buffer);
+        Document Parse(std::string_view buffer, Document&& recycled);
+        std::vector<Document> ParseMany(const std::vector<std::string_view>& buffers);
+        void Recycle(Document&& doc);
+
+    private:
+        friend Document Load(std::istream& input, const LoadSettings& settings);
+
+        class BufferReader : public std::streambuf {
+        public:
+            void Reset(std::string_view buffer);
+
+        protected:
+            pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+        };
+
+        struct Frame {
+            bool is_dict = false;
+            Array array;
+            Dict dict;
+            std::string key;
+            const Projection* projection = nullptr;
+            const Projection* value_projection = nullptr;
+        };
+
+        Document ParseSource(std::string source);
+        Node ParseNode(std::istream& input);
+        Frame& Push(bool is_dict, const Projection* projection);
+        Node Pop();
+        void Append(Frame& frame, Node&& value);
+        void OpenMap(std::istream& input);
+        void CloseMap(std::istream& input);
+        void AttachMap(const Frame& frame);
+        bool NextValue(std::istream& input, Frame& frame, bool first);
+        std::string TakeString();
+
+        LoadSettings settings_;
+        std::vector<Frame> frames_;
+        std::size_t depth_ = 0;
+        // Source maps of the open containers and of the last finished
+        // value; only used with LoadSettings::keep_source.
+        std::vector<SourceMap> maps_;
+        SourceMap value_map_;
+        SourceMap source_map_;
+        std::string number_buffer_;
+        std::string skip_buffer_;
+        std::vector<Array> arrays_;
+        std::vector<Dict::node_type> dict_nodes_;
+        std::vector<std::string> strings_;
+        std::vector<Node> recycle_stack_;
+        BufferReader reader_;
+        std::istream input_;
     };
 
     Document Load(std::istream& input);
+    Document Load(std::istream& input, const Projection& projection);
+    Document Load(std::istream& input, const LoadSettings& settings);
+
+    struct PrintSettings {
+        // Worker threads; zero means one per hardware thread. Taken from a
+        // process-wide pool that keeps them between calls.
+        std::size_t threads = 0;
+        // Approximate number of nodes serialized by one task; smaller
+        // documents are printed on the calling thread.
+        std::size_t chunk_size = 16384;
+    };
 
     void Print(const Document& doc, std::ostream& output);
+    // Serializes chunks of large containers concurrently and writes them
+    // to output in order while later chunks are still being serialized.
+    void Print(const Document& doc, std::ostream& output, const PrintSettings& settings);
+
+} // namespace json
+
+namespace std {
+
+    // O(n) per lookup, see Node::Hash; key sets of large trees should hold
+    // Documents, whose hash is memoized.
+    template <>
+    struct hash<json::Node> {
+        size_t operator()(const json::Node& node) const {
+            return node.Hash();
+        }
+    };
+
+    template <>
+    struct hash<json::Document> {
+        size_t operator()(const json::Document& doc) const {
+            return doc.Hash();
+        }
+    };
 
-} // namespace json
\ No newline at end of file
+} // namespace std
\ No newline at end of file